@@ -0,0 +1,322 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <omp.h>
+#include "matrix.h"
+#include "conv_utils.h"
+#include "neuralNet.h"
+#include "evaluation.h"
+#include "data.h"
+
+//Number of training images convolved per timing run of the conv candidates
+#define TUNE_CONV_SAMPLES 200
+//Number of repetitions per candidate of the per-sample GEMMs
+#define TUNE_GEMM_REPS 50
+//Number of repetitions per candidate of the batched GEMM
+#define TUNE_BATCH_REPS 5
+
+/*
+Runtime kernel autotuner.
+Whether OpenMP, tiling or im2col pays off depends on the machine and on
+filterSize/numFilters, so instead of hard-coding it the candidate kernels
+are timed once with the real shapes. Every kind of GEMM (per-sample
+forward, weight gradient, batched, im2col) is tuned on its own. The winners are stored in a cache
+file keyed by CPU model and shapes, and simply loaded on later runs.
+Delete the cache file to force a re-tune.
+*/
+
+//The complete kernel selection for one machine and model shape
+struct KernelConfig {
+    ConvAlgo convAlgo = CONV_DIRECT;
+    int convThreads = 1;
+    GemmConfig im2col;
+    DenseGemmConfig dense;
+};
+
+//The operand pairs of one kind of GEMM, as they occur in the model
+typedef std::vector<std::pair<Matrix, Matrix>> GemmWorkload;
+
+class Autotuner {
+public:
+
+    //Human readable CPU model, used as part of the cache key
+    static std::string cpuModel() {
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line)) {
+            if (line.compare(0, 10, "model name") == 0) {
+                size_t colon = line.find(':');
+                if (colon != std::string::npos) {
+                    return trim(line.substr(colon + 1));
+                }
+            }
+        }
+#ifdef __APPLE__
+        FILE* pipe = popen("sysctl -n machdep.cpu.brand_string", "r");
+        if (pipe) {
+            char buffer[256];
+            std::string brand;
+            while (fgets(buffer, sizeof(buffer), pipe)) {
+                brand += buffer;
+            }
+            pclose(pipe);
+            if (!trim(brand).empty()) {
+                return trim(brand);
+            }
+        }
+#endif
+        return "unknown-cpu";
+    }
+
+    //Cache key: CPU model, available threads and every shape the kernels see
+    static std::string cacheKey(const ConvLayer& cnn) {
+        std::ostringstream key;
+        key << cpuModel()
+            << "|threads=" << omp_get_max_threads()
+            << "|input=" << cnn.getInputSize()
+            << "|filterSize=" << cnn.getFilterSize()
+            << "|numFilters=" << cnn.getNumFilters()
+            << "|flatSize=" << cnn.flatSize;
+        return key.str();
+    }
+
+    //Loads the configuration for "cnn" from the cache file, or tunes it and
+    //stores the result. The chosen kernels are applied to "cnn" and "flat".
+    static KernelConfig configure(ConvLayer& cnn, NeuralNet& flat, const std::vector<MNISTImage>& samples,
+                                  const std::string& cacheFile) {
+        std::string key = cacheKey(cnn);
+        KernelConfig config;
+
+        if (loadFromCache(cacheFile, key, config)) {
+            std::cout << "Loaded kernel configuration from " << cacheFile << std::endl;
+        } else {
+            std::cout << "No cached kernel configuration for this machine and shape. Tuning..." << std::endl;
+            config = tune(cnn, samples);
+            saveToCache(cacheFile, key, config);
+        }
+
+        apply(cnn, flat, config);
+        std::cout << "Kernels: conv=" << (config.convAlgo == CONV_IM2COL ? "im2col" : "direct")
+                  << " convThreads=" << config.convThreads
+                  << " im2col=" << describe(config.im2col)
+                  << " gemv=" << describe(config.dense.gemv)
+                  << " outer=" << describe(config.dense.outer)
+                  << " batch=" << describe(config.dense.batch) << std::endl;
+        return config;
+    }
+
+    static void apply(ConvLayer& cnn, NeuralNet& flat, const KernelConfig& config) {
+        cnn.setKernelConfig(config.convAlgo, config.convThreads, config.im2col);
+        flat.setGemmConfig(config.dense);
+    }
+
+    //Times every candidate with the real shapes and returns the fastest.
+    //The GEMMs are tuned first since the im2col convolution runs through one.
+    static KernelConfig tune(ConvLayer& cnn, const std::vector<MNISTImage>& samples) {
+        KernelConfig best;
+        std::vector<int> threadCounts = candidateThreadCounts();
+
+        //Widths of the dense layers, input first
+        const size_t widths[] = {cnn.flatSize, LAYER_1_SIZE, LAYER_2_SIZE, OUTPUT_SIZE};
+        GemmWorkload gemv, outer, batch;
+        for (int l = 0; l < 3; ++l) {
+            //Forward pass of one sample, its weight gradient, and a batched evaluation pass
+            gemv.push_back(randomOperands({1, widths[l]}, {widths[l], widths[l + 1]}));
+            outer.push_back(randomOperands({widths[l], 1}, {1, widths[l + 1]}));
+            batch.push_back(randomOperands({EVAL_BATCH_SIZE, widths[l]}, {widths[l], widths[l + 1]}));
+            //The gradient backpropagated through the weights of layers 2 and 3
+            if (l > 0) {
+                gemv.push_back(randomOperands({1, widths[l + 1]}, {widths[l + 1], widths[l]}));
+            }
+        }
+        //The im2col convolution of one image against all filters
+        size_t patchSize = cnn.getFilterSize() * cnn.getFilterSize();
+        Matrix image = Matrix::initializeRandom({cnn.getInputSize(), cnn.getInputSize()}, 0.0, 1.0);
+        GemmWorkload im2col(1, std::make_pair(cnn.im2col(image),
+                                              Matrix::initializeRandom({patchSize, cnn.getNumFilters()}, -1.0, 1.0)));
+
+        double gemmTime = 0.0;
+        best.dense.gemv = tuneGemm(gemv, TUNE_GEMM_REPS, threadCounts, gemmTime);
+        best.dense.outer = tuneGemm(outer, TUNE_GEMM_REPS, threadCounts, gemmTime);
+        best.dense.batch = tuneGemm(batch, TUNE_BATCH_REPS, threadCounts, gemmTime);
+        best.im2col = tuneGemm(im2col, TUNE_GEMM_REPS, threadCounts, gemmTime);
+
+        size_t numSamples = std::min(samples.size(), static_cast<size_t>(TUNE_CONV_SAMPLES));
+        double bestConvTime = -1.0;
+        auto timeConv = [&](ConvAlgo algo, int threads) {
+            cnn.setKernelConfig(algo, threads, best.im2col);
+            double elapsed = timeIt([&]() {
+                for (size_t i = 0; i < numSamples; ++i) {
+                    cnn.forwardPropagation(samples[i].imageTensor);
+                }
+            });
+            if (bestConvTime < 0 || elapsed < bestConvTime) {
+                bestConvTime = elapsed;
+                best.convAlgo = algo;
+                best.convThreads = threads;
+            }
+        };
+        for (int threads : threadCounts) {
+            timeConv(CONV_DIRECT, threads);
+        }
+        timeConv(CONV_IM2COL, 1);
+
+        std::cout << "Tuning done: GEMM " << gemmTime << " s, conv " << bestConvTime << " s" << std::endl;
+        return best;
+    }
+
+private:
+
+    static std::string trim(const std::string& str) {
+        size_t first = str.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos) {
+            return "";
+        }
+        size_t last = str.find_last_not_of(" \t\r\n");
+        return str.substr(first, last - first + 1);
+    }
+
+    static std::string describe(const GemmConfig& config) {
+        std::ostringstream text;
+        text << "tile " << config.tile << "/threads " << config.threads;
+        return text.str();
+    }
+
+    static std::pair<Matrix, Matrix> randomOperands(std::vector<size_t> leftDims, std::vector<size_t> rightDims) {
+        return std::make_pair(Matrix::initializeRandom(leftDims, -1.0, 1.0),
+                              Matrix::initializeRandom(rightDims, -1.0, 1.0));
+    }
+
+    //Fastest tile size and thread count for "workload", each candidate
+    //running every GEMM in it "reps" times. Adds the best time to "totalTime".
+    static GemmConfig tuneGemm(const GemmWorkload& workload, int reps,
+                               const std::vector<int>& threadCounts, double& totalTime) {
+        const size_t tiles[] = {0, 16, 32, 64};
+        GemmConfig best;
+        double bestTime = -1.0;
+        for (size_t tile : tiles) {
+            for (int threads : threadCounts) {
+                GemmConfig candidate;
+                candidate.tile = tile;
+                candidate.threads = threads;
+                double elapsed = timeIt([&]() {
+                    for (int r = 0; r < reps; ++r) {
+                        for (const auto& operands : workload) {
+                            operands.first.matrixMultiply(operands.second, candidate);
+                        }
+                    }
+                });
+                if (bestTime < 0 || elapsed < bestTime) {
+                    bestTime = elapsed;
+                    best = candidate;
+                }
+            }
+        }
+        totalTime += bestTime;
+        return best;
+    }
+
+    //1, 2, 4, ... up to the number of available threads (always included)
+    static std::vector<int> candidateThreadCounts() {
+        int maxThreads = std::max(1, omp_get_max_threads());
+        std::vector<int> counts;
+        for (int t = 1; t < maxThreads; t *= 2) {
+            counts.push_back(t);
+        }
+        counts.push_back(maxThreads);
+        return counts;
+    }
+
+    //Best of three runs, to filter out warm-up and scheduling noise
+    template <typename Fn>
+    static double timeIt(Fn fn) {
+        double best = -1.0;
+        for (int run = 0; run < 3; ++run) {
+            auto start = std::chrono::high_resolution_clock::now();
+            fn();
+            auto end = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double> elapsed = end - start;
+            if (best < 0 || elapsed.count() < best) {
+                best = elapsed.count();
+            }
+        }
+        return best;
+    }
+
+    //Cache file format, one line per key:
+    //key <TAB> convAlgo <TAB> convThreads, then <TAB> tile <TAB> threads for the
+    //im2col, gemv, outer and batch GEMMs in that order. Entries in an older
+    //format do not parse and are tuned again.
+    static bool loadFromCache(const std::string& cacheFile, const std::string& key, KernelConfig& config) {
+        std::ifstream file(cacheFile);
+        std::string line;
+        while (std::getline(file, line)) {
+            size_t tab = line.find('\t');
+            if (tab == std::string::npos || line.substr(0, tab) != key) {
+                continue;
+            }
+            std::istringstream fields(line.substr(tab + 1));
+            int algo, convThreads;
+            KernelConfig parsed;
+            if ((fields >> algo >> convThreads) && readGemm(fields, parsed.im2col)
+                && readGemm(fields, parsed.dense.gemv) && readGemm(fields, parsed.dense.outer)
+                && readGemm(fields, parsed.dense.batch)) {
+                parsed.convAlgo = algo == CONV_IM2COL ? CONV_IM2COL : CONV_DIRECT;
+                parsed.convThreads = std::max(1, convThreads);
+                config = parsed;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool readGemm(std::istream& fields, GemmConfig& config) {
+        size_t tile;
+        int threads;
+        if (!(fields >> tile >> threads)) {
+            return false;
+        }
+        config.tile = tile;
+        config.threads = std::max(1, threads);
+        return true;
+    }
+
+    //Rewrites the cache file, replacing any previous entry for "key"
+    static void saveToCache(const std::string& cacheFile, const std::string& key, const KernelConfig& config) {
+        std::vector<std::string> lines;
+        {
+            std::ifstream file(cacheFile);
+            std::string line;
+            while (std::getline(file, line)) {
+                if (line.substr(0, line.find('\t')) != key) {
+                    lines.push_back(line);
+                }
+            }
+        }
+
+        std::ostringstream entry;
+        entry << key << '\t' << static_cast<int>(config.convAlgo) << '\t' << config.convThreads;
+        for (const GemmConfig* gemm : {&config.im2col, &config.dense.gemv, &config.dense.outer, &config.dense.batch}) {
+            entry << '\t' << gemm->tile << '\t' << gemm->threads;
+        }
+        lines.push_back(entry.str());
+
+        std::ofstream file(cacheFile, std::ios::trunc);
+        if (!file.is_open()) {
+            std::cerr << "Failed to write kernel tuning cache: " << cacheFile << std::endl;
+            return;
+        }
+        for (const auto& line : lines) {
+            file << line << '\n';
+        }
+    }
+};
+
+#endif
@@ -1 +1 @@
-clang++ -std=c++11 -o runModel runModel.cpp -O3 -march=native -funroll-loops -ftree-vectorize -ffast-math -Wall -fopenmp
+clang++ -std=c++11 -o runModel runModel.cpp -O3 -march=native -funroll-loops -ftree-vectorize -ffast-math -Wall -fopenmp -pthread
@@ -1,8 +1,18 @@
+#ifndef CONV_UTILS_H
+#define CONV_UTILS_H
+
 #include <iostream>
 #include <algorithm>
+#include <numeric>
 #include <omp.h>
 #include "matrix.h"
 
+//Available implementations of the convolution.
+//CONV_DIRECT slides every filter over the image one at a time,
+//CONV_IM2COL unrolls the image patches once and does a single GEMM
+//against all the filters.
+enum ConvAlgo { CONV_DIRECT = 0, CONV_IM2COL = 1 };
+
 /*
 The ConvLayer class. Creates objects that 
 have the functionality to perform convolution over an image.
@@ -22,6 +32,14 @@ private:
     bool useReLU;                 
     size_t poolSize;
     size_t pool_stride;
+    //All filters as the columns of one {filterRows * filterCols, numFilters} matrix,
+    //used by the im2col path. The filters are not trained, so it is built once.
+    Matrix filterBank;
+    //Kernel choice, normally set by the autotuner (autotune.h)
+    ConvAlgo convAlgo = CONV_DIRECT;
+    int convThreads = 8;
+    //Configuration of the im2col GEMM
+    GemmConfig gemm;
     
 
 public:
@@ -45,6 +63,34 @@ public:
         }
         //Used to instantiate the Flat fully-connected NeuralNet object
         calculateFlatSize();
+
+        size_t patchSize = this->filterSize[0] * this->filterSize[1];
+        filterBank = Matrix({patchSize, numFilters});
+        for (size_t f = 0; f < numFilters; ++f) {
+            for (size_t p = 0; p < patchSize; ++p) {
+                filterBank.setElement(p, f, filters[f].getData()[p]);
+            }
+        }
+    }
+
+    size_t getInputSize() const { return input_size; }
+    size_t getFilterSize() const { return filterSize[0]; }
+    size_t getNumFilters() const { return numFilters; }
+    ConvAlgo getConvAlgo() const { return convAlgo; }
+    int getConvThreads() const { return convThreads; }
+    const GemmConfig& getGemmConfig() const { return gemm; }
+
+    //Threads a forward pass of this layer may occupy
+    int getMaxThreads() const {
+        return convAlgo == CONV_IM2COL ? gemm.threads : convThreads;
+    }
+
+    //Selects the convolution kernel. "threads" only applies to CONV_DIRECT;
+    //CONV_IM2COL is parallelised through "im2colGemm" instead.
+    void setKernelConfig(ConvAlgo algo, int threads, const GemmConfig& im2colGemm) {
+        convAlgo = algo;
+        convThreads = std::max(1, threads);
+        gemm = im2colGemm;
     }
 
     //Calculate the final dims of the flattened output from the ConvLayer 
@@ -59,7 +105,7 @@ public:
     }
 
     //The actual convolution operation
-    Matrix convolve(const Matrix& input, const Matrix& filter) {
+    Matrix convolve(const Matrix& input, const Matrix& filter) const {
         size_t inputRows = input.getDims()[0];
         size_t inputCols = input.getDims()[1];
         size_t filterRows = filter.getDims()[0];
@@ -92,7 +138,7 @@ public:
     }
 
     //The pooling operation
-    Matrix pool(const std::string& poolType, const Matrix& input) {
+    Matrix pool(const std::string& poolType, const Matrix& input) const {
         if (poolType != "max" && poolType != "avg") {
             throw std::runtime_error("Unknown pooling type. Use \"max\" or \"avg\" ");
         }
@@ -123,10 +169,62 @@ public:
         return result;
     }
 
+    //Unrolls every filter-sized patch of the input into a row of the result.
+    //The result is {convOutputRows * convOutputCols, filterRows * filterCols}.
+    Matrix im2col(const Matrix& input) const {
+        size_t inputCols = input.getDims()[1];
+        size_t resultRows = ((input.getDims()[0] - filterSize[0]) / conv_stride) + 1;
+        size_t resultCols = ((inputCols - filterSize[1]) / conv_stride) + 1;
+        size_t patchSize = filterSize[0] * filterSize[1];
+
+        Matrix patches({resultRows * resultCols, patchSize});
+        const std::vector<double>& in = input.getData();
+        std::vector<double>& out = patches.getData();
+
+        for (size_t i = 0; i < resultRows; ++i) {
+            for (size_t j = 0; j < resultCols; ++j) {
+                double* row = out.data() + (i * resultCols + j) * patchSize;
+                for (size_t k = 0; k < filterSize[0]; ++k) {
+                    const double* src = in.data() + (i * conv_stride + k) * inputCols + j * conv_stride;
+                    std::copy(src, src + filterSize[1], row + k * filterSize[1]);
+                }
+            }
+        }
+        return patches;
+    }
+
+    //Convolution of the input with every filter as one GEMM (run with
+    //"config"), followed by ReLU and max pooling of each filter's response.
+    Matrix convPoolIm2col(const Matrix& input, const GemmConfig& config) const {
+        size_t resultRows = ((input.getDims()[0] - filterSize[0]) / conv_stride) + 1;
+        size_t resultCols = ((input.getDims()[1] - filterSize[1]) / conv_stride) + 1;
+
+        Matrix response = im2col(input).matrixMultiply(filterBank, config);
+        if (useReLU) {
+            response.relu();
+        }
+
+        std::vector<Matrix> conv_pool_ops(numFilters);
+        const std::vector<double>& responseData = response.getData();
+        for (size_t f = 0; f < numFilters; ++f) {
+            Matrix featureMap({resultRows, resultCols});
+            std::vector<double>& mapData = featureMap.getData();
+            for (size_t p = 0; p < mapData.size(); ++p) {
+                mapData[p] = responseData[p * numFilters + f];
+            }
+            conv_pool_ops[f] = pool("max", featureMap);
+        }
+        return Matrix::flattenMatrices(conv_pool_ops);
+    }
+
     Matrix forwardPropagation(const Matrix& input){
+        if (convAlgo == CONV_IM2COL) {
+            return convPoolIm2col(input, gemm);
+        }
+
         std::vector<Matrix> conv_pool_ops(numFilters);
 
-        #pragma omp parallel for num_threads(8)
+        #pragma omp parallel for num_threads(convThreads)
         for(int  i = 0; i < numFilters; i++){
             Matrix tmp = convolve(input, filters[i]);
             Matrix tmp2 = pool("max", tmp);
@@ -138,4 +236,26 @@ public:
         return result;
     }
 
-};
\ No newline at end of file
+    //Read-only, single-threaded variant of forwardPropagation.
+    //Meant to be called from an outer parallel loop (e.g. evaluation),
+    //where each thread handles whole images instead of single filters.
+    //The im2col GEMM keeps its tuned tile size but runs on one thread.
+    Matrix infer(const Matrix& input) const {
+        if (convAlgo == CONV_IM2COL) {
+            GemmConfig serial = gemm;
+            serial.threads = 1;
+            return convPoolIm2col(input, serial);
+        }
+
+        std::vector<Matrix> conv_pool_ops(numFilters);
+
+        for(size_t i = 0; i < numFilters; i++){
+            conv_pool_ops[i] = pool("max", convolve(input, filters[i]));
+        }
+
+        return Matrix::flattenMatrices(conv_pool_ops);
+    }
+
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include <vector>
 #include <cstdint>
 #include <stdexcept> 
+#include <memory>
 #include "matrix.h"
 
 /*
@@ -23,6 +24,10 @@ struct MNISTImage {
     int label;
 };
 
+//A loaded dataset. Held through a shared pointer to const so that
+//several models can read the same images without copying them.
+typedef std::shared_ptr<const std::vector<MNISTImage>> SharedDataset;
+
 //Load the file and return a vector of images represented as a struct
 std::vector<MNISTImage> readImages(const std::string &filenameImgs, const std::string &filenameLbls) {
     std::vector<MNISTImage> images;
@@ -0,0 +1,156 @@
+#ifndef EVALUATION_H
+#define EVALUATION_H
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <omp.h>
+#include "conv_utils.h"
+#include "neuralNet.h"
+
+//Number of images pushed through the dense layers at once during evaluation
+#define EVAL_BATCH_SIZE 64
+
+/*
+Evaluation utilities.
+Runs a trained ConvLayer + NeuralNet pair over a dataset in batches,
+spread across all available cores. The weights are only read, so
+the same model (or a snapshot of it) can be evaluated while training
+continues on another copy.
+*/
+
+//Results of a single evaluation pass
+struct EvalReport {
+    //confusion[actual][predicted]
+    std::vector<std::vector<int>> confusion;
+    int total = 0;
+    int correct = 0;
+    double seconds = 0.0;
+
+    double accuracy() const {
+        return total == 0 ? 0.0 : static_cast<double>(correct) / total;
+    }
+
+    //Of all samples predicted as "cls", the fraction that actually were "cls"
+    double precision(int cls) const {
+        int predicted = 0;
+        for (size_t actual = 0; actual < confusion.size(); ++actual) {
+            predicted += confusion[actual][cls];
+        }
+        return predicted == 0 ? 0.0 : static_cast<double>(confusion[cls][cls]) / predicted;
+    }
+
+    //Of all samples that actually were "cls", the fraction predicted as "cls"
+    double recall(int cls) const {
+        int actual = 0;
+        for (int count : confusion[cls]) {
+            actual += count;
+        }
+        return actual == 0 ? 0.0 : static_cast<double>(confusion[cls][cls]) / actual;
+    }
+
+    double imagesPerSecond() const {
+        return seconds > 0.0 ? total / seconds : 0.0;
+    }
+
+    void printConfusionMatrix() const {
+        std::cout << "Confusion matrix (rows = actual, cols = predicted):" << std::endl;
+        std::cout << "     ";
+        for (size_t p = 0; p < confusion.size(); ++p) {
+            std::cout << std::setw(6) << p;
+        }
+        std::cout << std::endl;
+        for (size_t a = 0; a < confusion.size(); ++a) {
+            std::cout << std::setw(5) << a;
+            for (int count : confusion[a]) {
+                std::cout << std::setw(6) << count;
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    void printPerClass() const {
+        std::cout << "Class  Precision  Recall" << std::endl;
+        for (size_t c = 0; c < confusion.size(); ++c) {
+            std::cout << std::setw(5) << c
+                      << std::setw(10) << std::fixed << std::setprecision(2) << precision(c) * 100.0 << "%"
+                      << std::setw(7) << recall(c) * 100.0 << "%" << std::endl;
+        }
+        std::cout.unsetf(std::ios_base::floatfield);
+        std::cout << std::setprecision(6);
+    }
+};
+
+//Conv features of data[first, first + count), one flattened image per row.
+//Meant for the dense layers' batched predictBatch.
+Matrix featureBatch(const ConvLayer& cnn, const std::vector<MNISTImage>& data,
+                    size_t first, size_t count) {
+    const size_t flatSize = cnn.flatSize;
+    Matrix batch({count, flatSize});
+    std::vector<double>& batchData = batch.getData();
+    for (size_t s = 0; s < count; ++s) {
+        Matrix features = cnn.infer(data[first + s].imageTensor);
+        std::copy(features.getData().begin(), features.getData().end(),
+                  batchData.begin() + s * flatSize);
+    }
+    return batch;
+}
+
+//Classifies every image in "data" and collects the confusion matrix.
+//Images are split into batches of "batchSize"; batches are distributed
+//over "numThreads" OpenMP threads (0 = all available), each with its own
+//partial confusion matrix.
+EvalReport evaluate(const ConvLayer& cnn, const NeuralNet& flat,
+                    const std::vector<MNISTImage>& data,
+                    size_t batchSize = EVAL_BATCH_SIZE,
+                    int numThreads = 0) {
+    EvalReport report;
+    report.confusion.assign(OUTPUT_SIZE, std::vector<int>(OUTPUT_SIZE, 0));
+    report.total = static_cast<int>(data.size());
+    if (data.empty()) {
+        return report;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    const int numBatches = static_cast<int>((data.size() + batchSize - 1) / batchSize);
+
+    if (numThreads <= 0) {
+        numThreads = omp_get_max_threads();
+    }
+
+    #pragma omp parallel num_threads(numThreads)
+    {
+        std::vector<std::vector<int>> localConfusion(OUTPUT_SIZE, std::vector<int>(OUTPUT_SIZE, 0));
+
+        #pragma omp for schedule(dynamic)
+        for (int b = 0; b < numBatches; ++b) {
+            size_t first = static_cast<size_t>(b) * batchSize;
+            size_t count = std::min(batchSize, data.size() - first);
+
+            Matrix probabilities = flat.predictBatch(featureBatch(cnn, data, first, count));
+            for (size_t s = 0; s < count; ++s) {
+                localConfusion[data[first + s].label][probabilities.argmaxRow(s)]++;
+            }
+        }
+
+        #pragma omp critical
+        for (int a = 0; a < OUTPUT_SIZE; ++a) {
+            for (int p = 0; p < OUTPUT_SIZE; ++p) {
+                report.confusion[a][p] += localConfusion[a][p];
+            }
+        }
+    }
+
+    for (int c = 0; c < OUTPUT_SIZE; ++c) {
+        report.correct += report.confusion[c][c];
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = end - start;
+    report.seconds = elapsed.count();
+    return report;
+}
+
+#endif
@@ -3,8 +3,17 @@
 
 #include <vector>
 #include <random>
+#include <algorithm>
 #include <stdexcept> 
 
+//Tunable parameters of Matrix::matrixMultiply.
+//tile == 0 computes every output column in one pass,
+//threads == 1 keeps the multiplication serial.
+struct GemmConfig {
+    size_t tile = 0;
+    int threads = 1;
+};
+
 /*
 The Matrix class.
 The backbone of the entire learning system.
@@ -49,6 +58,11 @@ public:
     }
 
 
+    const std::vector<double>& getData() const {
+        return data;
+    }
+
+
     const std::vector<size_t> getDims() const {
         return dims;
     }
@@ -97,6 +111,23 @@ public:
     }
 
 
+    //Index of the largest element in the given row of a 2-D matrix.
+    //Used when a whole batch of outputs is held in one matrix.
+    int argmaxRow(size_t row) const {
+        if (row >= dims[0]) {
+            throw std::out_of_range("Matrix row index out of range.");
+        }
+        const double* rowPtr = data.data() + row * dims[1];
+        int maxIdx = 0;
+        for (size_t j = 1; j < dims[1]; ++j) {
+            if (rowPtr[j] > rowPtr[maxIdx]) {
+                maxIdx = j;
+            }
+        }
+        return maxIdx;
+    }
+
+
     static Matrix zeros(const std::vector<size_t>& dimensions) {
         size_t totalSize = 1;
         for (size_t dim : dimensions) {
@@ -164,6 +195,15 @@ public:
         return Matrix(transposedData, transposedDims);
     }
 
+    //Copy of a single row as a {1, cols} row vector
+    Matrix getRow(size_t row) const {
+        if (row >= dims[0]) {
+            throw std::out_of_range("Matrix row index out of range.");
+        }
+        std::vector<double> rowData(data.begin() + row * dims[1], data.begin() + (row + 1) * dims[1]);
+        return Matrix(rowData, {1, dims[1]});
+    }
+
     Matrix flatten() const {
         std::vector<double> flatData = data; 
         std::vector<size_t> flatDims = {1, data.size()}; 
@@ -182,7 +222,16 @@ public:
     }
 
 
+    //The original serial loop. Layers that were tuned pass their own
+    //configuration to the overload below instead.
     Matrix matrixMultiply(const Matrix& other) const {
+        return matrixMultiply(other, GemmConfig());
+    }
+
+
+    //The output columns are cut into blocks of config.tile (0 = one block),
+    //and the (row, column block) pairs are shared among config.threads threads.
+    Matrix matrixMultiply(const Matrix& other, const GemmConfig& config) const {
         if (dims[1] != other.dims[0]) {
             throw std::invalid_argument("Matrix dimensions incompatible for multiplication.");
         }
@@ -190,12 +239,20 @@ public:
         std::vector<double> resultData(dims[0] * other.dims[1], 0.0);
         std::vector<size_t> resultDims = { dims[0], other.dims[1] };
 
-        // #pragma omp parallel for num_threads(8)
-        for (size_t i = 0; i < dims[0]; ++i) {
+        const size_t tile = (config.tile == 0 || config.tile > resultDims[1]) ? resultDims[1] : config.tile;
+        const long numBlocks = tile == 0 ? 0 : static_cast<long>((resultDims[1] + tile - 1) / tile);
+        const long numTasks = static_cast<long>(dims[0]) * numBlocks;
+
+        #pragma omp parallel for num_threads(config.threads) if(config.threads > 1 && numTasks > 1)
+        for (long t = 0; t < numTasks; ++t) {
+            size_t i = t / numBlocks;
+            size_t jStart = (t % numBlocks) * tile;
+            size_t jEnd = std::min(jStart + tile, resultDims[1]);
             for (size_t k = 0; k < dims[1]; ++k) {
-                if(data[i * dims[1] + k] != 0){
-                    for (size_t j = 0; j < other.dims[1]; ++j) {
-                        resultData[i * resultDims[1] + j] += data[i * dims[1] + k] * other.data[k * other.dims[1] + j];
+                double a = data[i * dims[1] + k];
+                if(a != 0){
+                    for (size_t j = jStart; j < jEnd; ++j) {
+                        resultData[i * resultDims[1] + j] += a * other.data[k * other.dims[1] + j];
                     }
                 }
             }
@@ -217,6 +274,23 @@ public:
     }
 
 
+    //Adds a {1, cols} row vector to every row of this matrix.
+    //Used to apply a bias to a batch of activations.
+    Matrix addRowVector(const Matrix& row) const {
+        if (row.dims.size() != 2 || row.dims[0] != 1 || row.dims[1] != dims[1]) {
+            throw std::invalid_argument("Row vector size must match matrix columns for broadcast addition.");
+        }
+        std::vector<double> resultData(data.size());
+
+        for (size_t i = 0; i < dims[0]; ++i) {
+            for (size_t j = 0; j < dims[1]; ++j) {
+                resultData[i * dims[1] + j] = data[i * dims[1] + j] + row.data[j];
+            }
+        }
+        return Matrix(resultData, dims);
+    }
+
+
     Matrix matrixSubtract(const Matrix& other) const {
         if (dims != other.dims) {
             throw std::invalid_argument("Matrix dimensions must match for subtraction.");
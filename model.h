@@ -1,5 +1,14 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <future>
+#include <memory>
 #include "conv_utils.h"
 #include "neuralNet.h"
+#include "evaluation.h"
+#include "autotune.h"
+#include "pipeline.h"
+#include "selective.h"
 
 //Top level declaration of training and testing
 // filenames. Make sure that they are in the same dir as your 
@@ -8,6 +17,10 @@
 #define TRAIN_LABELS_FILE "train-labels.idx1-ubyte"
 #define TEST_IMAGES_FILE "t10k-images.idx3-ubyte"
 #define TEST_LABELS_FILE "t10k-labels.idx1-ubyte"
+//Kernel choices found by the autotuner are stored here between runs
+#define TUNING_CACHE_FILE "kernel_tuning.cache"
+//Number of training images held back for validation when evalEvery is set
+#define VALIDATION_SIZE 10000
 
 /*
 The Model class. 
@@ -22,87 +35,364 @@ class Model{
 public:
     ConvLayer cnn;
     NeuralNet flat;
-    std::vector<MNISTImage> training_data;
-    std::vector<MNISTImage> testing_data;
+    SharedDataset training_data;
+    SharedDataset testing_data;
+    //Held out from the training images for the background validation,
+    //so that early stopping never looks at testing_data. Empty if evalEvery is 0.
+    SharedDataset validation_data;
     int epochs; 
     double learningRate;
+    //Run a background validation pass every "evalEvery" epochs (0 = never)
+    int evalEvery;
+    //Stop after this many background validations without improvement
+    int patience;
+    //Block sparsity the hidden layers are pruned to after training (0 = no pruning),
+    //reached in pruneSteps steps
+    double targetSparsity = 0.0;
+    int pruneSteps = 4;
+    //Pruning level and a copy of the network at that level, filled by pruneIteratively
+    std::vector<std::pair<double, NeuralNet>> pruningLevels;
+    //Micro-batch size of the pipelined trainer (0 = train sample by sample as before),
+    //and how many micro-batches the forward stage may run ahead of the weight updates.
+    //Per-sample SGD from this initialisation only tolerates a few samples of
+    //staleness, so keep microBatch * (maxStaleness + 1) around 16 or below.
+    size_t microBatch = 0;
+    size_t maxStaleness = 1;
+    //Skips the backward pass of low-loss samples when its skipQuantile is set (see selective.h)
+    SelectiveBackprop selector;
+    //Progress output goes to std::cout only when verbose
+    bool verbose = true;
+
+    //Outcome of the last call to train()
+    double trainAccuracy = 0.0;
+    int epochsRun = 0;
+    double trainSeconds = 0.0;
+    //Training time until the 98.5% training accuracy cut-off was reached (-1 = never)
+    double secondsTo985 = -1.0;
+
+    //The parametrized constructor. Loads the MNIST files and tunes the kernels.
+    Model(int filterSize,
+        int numFilters, 
+        double learning_rate, 
+        int epochs,
+        int evalEvery = 0,
+        int patience = 3 )
+        : Model(filterSize, numFilters, learning_rate, epochs,
+                loadData(TRAIN_IMAGES_FILE, TRAIN_LABELS_FILE),
+                loadData(TEST_IMAGES_FILE, TEST_LABELS_FILE),
+                evalEvery, patience){
+        Autotuner::configure(cnn, flat, *training_data, TUNING_CACHE_FILE);
+    }
 
-    //The parametrized constructor
+    //Constructor over already loaded data. The datasets are only read,
+    //so several models (e.g. a hyperparameter sweep) can share them.
+    //Kernel selection is left to the caller.
     Model(int filterSize,
         int numFilters, 
         double learning_rate, 
-        int epochs ){
-        training_data = loadData(TRAIN_IMAGES_FILE, TRAIN_LABELS_FILE);
-        testing_data = loadData(TEST_IMAGES_FILE, TEST_LABELS_FILE);
-        cnn = ConvLayer(training_data[0].rows, static_cast<size_t>(filterSize), static_cast<size_t>(numFilters));
+        int epochs,
+        SharedDataset training_data,
+        SharedDataset testing_data,
+        int evalEvery = 0,
+        int patience = 3 ){
+        if (!training_data || training_data->empty()) {
+            throw std::invalid_argument("Training data is empty.");
+        }
+        this->training_data = training_data;
+        this->testing_data = testing_data;
+        if (evalEvery > 0) {
+            splitValidation();
+        }
+        cnn = ConvLayer((*training_data)[0].rows, static_cast<size_t>(filterSize), static_cast<size_t>(numFilters));
         flat = NeuralNet(cnn.flatSize);
         this->learningRate = learning_rate;
         this->epochs = epochs;
+        this->evalEvery = evalEvery;
+        this->patience = patience;
     }
 
     //Loads the MNIST data from a specified filename into a format that the program requires.
-    std::vector<MNISTImage> loadData(const std::string &filenameImgs, const std::string &filenameLbls) {
-        std::vector<MNISTImage> images = readImages(filenameImgs, filenameLbls);
-        return images;
+    static SharedDataset loadData(const std::string &filenameImgs, const std::string &filenameLbls) {
+        return std::make_shared<const std::vector<MNISTImage>>(readImages(filenameImgs, filenameLbls));
+    }
+
+    //Moves the last VALIDATION_SIZE training images (at most a sixth of them)
+    //into validation_data. The shared training set itself is left untouched.
+    void splitValidation() {
+        const std::vector<MNISTImage>& all = *training_data;
+        size_t numValidation = std::min(static_cast<size_t>(VALIDATION_SIZE), all.size() / 6);
+        if (numValidation == 0) {
+            throw std::invalid_argument("Too few training images to hold out a validation set.");
+        }
+        auto split = all.end() - numValidation;
+        validation_data = std::make_shared<const std::vector<MNISTImage>>(split, all.end());
+        training_data = std::make_shared<const std::vector<MNISTImage>>(all.begin(), split);
     }
 
     //The entire training lifecycle
     void train(){
-        for (int epoch = 0; epoch < epochs; ++epoch) {
-            auto start = std::chrono::high_resolution_clock::now();
+        auto trainStart = std::chrono::high_resolution_clock::now();
+        epochsRun = 0;
+        secondsTo985 = -1.0;
+        double epochSecondsSoFar = 0.0;
 
-            std::cout << "EPOCH " << epoch + 1 << std::endl;
-            int correctPredictions = 0;
+        //State of the background validation. The snapshot is a private copy
+        //of the weights, so training can keep updating "flat" meanwhile.
+        std::future<EvalReport> pendingEval;
+        std::shared_ptr<const NeuralNet> pendingSnapshot;
+        int pendingEpoch = 0;
+        std::shared_ptr<const NeuralNet> bestSnapshot;
+        double bestValAccuracy = -1.0;
+        int evalsWithoutImprovement = 0;
 
-            for (int i = 0; i < training_data.size(); i++) {  
-                Matrix input = cnn.forwardPropagation(training_data[i].imageTensor); 
-                Matrix target = createTargetMatrix(training_data[i].label);  
+        //Folds a finished validation into the early stopping state.
+        //Returns true if training should stop.
+        auto harvest = [&]() {
+            EvalReport report = pendingEval.get();
+            if (verbose) {
+                std::cout << "Validation (epoch " << pendingEpoch << " snapshot) Accuracy = "
+                          << report.accuracy() * 100.0 << "%, "
+                          << report.imagesPerSecond() << " images/sec" << std::endl;
+            }
+            if (report.accuracy() > bestValAccuracy) {
+                bestValAccuracy = report.accuracy();
+                bestSnapshot = pendingSnapshot;
+                evalsWithoutImprovement = 0;
+            } else {
+                evalsWithoutImprovement++;
+            }
+            pendingSnapshot.reset();
+            return evalsWithoutImprovement >= patience;
+        };
 
-                flat.forwardPropagation(input);
-                int predictedLabel = flat.output.argmax();
-                if (predictedLabel == training_data[i].label) {
-                    correctPredictions++;
-                }
+        bool stopEarly = false;
+        for (int epoch = 0; epoch < epochs; ++epoch) {
+            auto start = std::chrono::high_resolution_clock::now();
 
-                flat.backwardPropagation(target, learningRate);
+            if (verbose) {
+                std::cout << "EPOCH " << epoch + 1 << std::endl;
             }
-
-            double accuracy = static_cast<double>(correctPredictions) / training_data.size();
-            std::cout << "Accuracy = " << accuracy * 100.0 << "%" << std::endl;
+            double accuracy = trainEpoch(epoch);
+            trainAccuracy = accuracy;
+            epochsRun = epoch + 1;
 
             auto end = std::chrono::high_resolution_clock::now();
             std::chrono::duration<double> elapsed = end - start;
-            std::cout << "Epoch " << epoch + 1 << " Time: " << elapsed.count() << " seconds" << std::endl;
-            std::cout << "----------------------------------------------------\n";
+            epochSecondsSoFar += elapsed.count();
+            if (verbose) {
+                std::cout << "Accuracy = " << accuracy * 100.0 << "%" << std::endl;
+                std::cout << "Epoch " << epoch + 1 << " Time: " << elapsed.count() << " seconds" << std::endl;
+                if (selector.enabled() && microBatch == 0) {
+                    std::cout << "Backward passes run: " << selector.epochBackward << " for "
+                              << selector.epochSamples << " samples (" << selector.epochSavedFraction() * 100.0
+                              << "% saved), including " << selector.epochRevisits
+                              << " revisits that cost an extra forward pass each" << std::endl;
+                }
+                std::cout << "----------------------------------------------------\n";
+            }
+
+            if (pendingEval.valid() &&
+                pendingEval.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                stopEarly = harvest();
+            }
+            if (stopEarly) {
+                if (verbose) {
+                    std::cout << "Validation accuracy has not improved for " << patience
+                              << " evaluations. Stopping early." << std::endl;
+                }
+                break;
+            }
+            //Only one validation runs at a time; if the previous one is still
+            //busy this epoch's snapshot is skipped rather than stalling training.
+            if (evalEvery > 0 && (epoch + 1) % evalEvery == 0 && !pendingEval.valid()) {
+                pendingSnapshot = std::make_shared<const NeuralNet>(flat);
+                pendingEpoch = epoch + 1;
+                std::shared_ptr<const NeuralNet> snapshot = pendingSnapshot;
+                const ConvLayer& conv = cnn;
+                SharedDataset validation = validation_data;
+                //Leave the cores the training loop uses to the training loop
+                const DenseGemmConfig& dense = flat.getGemmConfig();
+                int trainThreads = std::max(cnn.getMaxThreads(), std::max(dense.gemv.threads, dense.outer.threads));
+                int evalThreads = std::max(1, omp_get_num_procs() - trainThreads);
+                pendingEval = std::async(std::launch::async, [snapshot, &conv, validation, evalThreads]() {
+                    return evaluate(conv, *snapshot, *validation, EVAL_BATCH_SIZE, evalThreads);
+                });
+            }
 
             if(accuracy * 100.0 > 98.5){
+                secondsTo985 = epochSecondsSoFar;
+                if (verbose) {
+                    std::cout << "Reached 98.5% training accuracy after " << epochsRun << " epochs, "
+                              << secondsTo985 << " seconds of training" << std::endl;
+                }
                 break;
             }
         }
+        if (verbose && selector.enabled() && microBatch == 0) {
+            std::cout << "Selective backprop saved " << selector.totalSavedFraction() * 100.0
+                      << "% of the backward passes and added " << selector.totalRevisits
+                      << " revisit forward passes" << std::endl;
+        }
+
+        if (pendingEval.valid()) {
+            harvest();
+        }
+        //Keep the weights that generalised best, not merely the latest ones
+        if (bestSnapshot) {
+            if (verbose) {
+                std::cout << "Restoring weights with best validation accuracy = "
+                          << bestValAccuracy * 100.0 << "%" << std::endl;
+            }
+            flat = *bestSnapshot;
+        }
+
+        if (targetSparsity > 0.0) {
+            pruneIteratively();
+        }
+
+        std::chrono::duration<double> trainElapsed = std::chrono::high_resolution_clock::now() - trainStart;
+        trainSeconds = trainElapsed.count();
     }
-    
-    //Reports test accuracy
-    void test() {
+
+    //One pass over the training set. Returns the training accuracy.
+    //With selective backprop the hardest samples are visited a second time at
+    //the end; only the first visit of each sample counts towards the accuracy.
+    //The pipelined trainer always runs every backward pass.
+    double trainEpoch(int epoch) {
+        if (microBatch > 0) {
+            return runPipelinedEpoch(cnn, flat, *training_data, learningRate, microBatch, maxStaleness);
+        }
+
+        const std::vector<MNISTImage>& train_set = *training_data;
+        std::vector<size_t> order = selector.beginEpoch(epoch, train_set.size());
         int correctPredictions = 0;
-        int totalPredictions = testing_data.size();
 
-        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t v = 0; v < order.size(); v++) {  
+            size_t i = order[v];
+            Matrix input = cnn.forwardPropagation(train_set[i].imageTensor); 
 
-        for (const auto& image : testing_data) {
-            Matrix input = cnn.forwardPropagation(image.imageTensor);
             flat.forwardPropagation(input);
             int predictedLabel = flat.output.argmax();
-
-            if (predictedLabel == image.label) {
+            if (predictedLabel == train_set[i].label && v < train_set.size()) {
                 correctPredictions++;
             }
+
+            //The loss is only needed, and only computed, for selective backprop
+            bool backprop = true;
+            if (selector.enabled()) {
+                double loss = SelectiveBackprop::sampleLoss(flat.output, train_set[i].label);
+                backprop = selector.shouldBackprop(epoch, i, loss);
+            }
+            if (backprop) {
+                Matrix target = createTargetMatrix(train_set[i].label);  
+                flat.backwardPropagation(target, learningRate);
+            }
+        }
+
+        return static_cast<double>(correctPredictions) / train_set.size();
+    }
+
+    //Raises the sparsity of the hidden layers to targetSparsity in pruneSteps
+    //equal steps, fine-tuning the surviving weights for one epoch after each.
+    //A copy of the network is kept at every level for test() to compare.
+    void pruneIteratively() {
+        pruningLevels.clear();
+        pruningLevels.push_back(std::make_pair(0.0, flat));
+
+        for (int step = 1; step <= pruneSteps; ++step) {
+            double level = targetSparsity * step / pruneSteps;
+            flat.prune(level);
+            double accuracy = trainEpoch(epochsRun + step);
+            if (verbose) {
+                std::cout << "Pruned to " << level * 100.0 << "% block sparsity, fine-tuned Accuracy = "
+                          << accuracy * 100.0 << "%" << std::endl;
+            }
+            pruningLevels.push_back(std::make_pair(level, flat));
+        }
+        flat.buildSparse();
+    }
+    
+    //Reports test accuracy, the confusion matrix, per-class precision/recall
+    //and throughput. Runs batched across all cores; see evaluation.h.
+    EvalReport test() {
+        EvalReport report = evaluate(cnn, flat, *testing_data);
+        if (!verbose) {
+            return report;
+        }
+
+        std::cout << "Testing Accuracy = " << report.accuracy() * 100.0 << "%" << std::endl;
+        report.printConfusionMatrix();
+        report.printPerClass();
+
+        std::cout << "Testing completed in " << report.seconds << " seconds ("
+                  << report.imagesPerSecond() << " images/sec)" << std::endl;
+
+        if (!pruningLevels.empty()) {
+            reportPruningTradeoff();
+        }
+        return report;
+    }
+
+    //Accuracy, weight memory and dense layer speed of the network at every
+    //pruning level. Level 0 is the unpruned network on the dense kernels, the
+    //others use the block-sparse kernels. Pruning leaves the conv layer alone,
+    //so the conv features of the test set are computed once and only the
+    //dense layers (predictBatch) are timed, single-threaded, best of 3 runs.
+    void reportPruningTradeoff() {
+        const std::vector<MNISTImage>& test_set = *testing_data;
+        const int numBatches = static_cast<int>((test_set.size() + EVAL_BATCH_SIZE - 1) / EVAL_BATCH_SIZE);
+        std::vector<Matrix> features(numBatches);
+        #pragma omp parallel for schedule(dynamic)
+        for (int b = 0; b < numBatches; ++b) {
+            size_t first = static_cast<size_t>(b) * EVAL_BATCH_SIZE;
+            features[b] = featureBatch(cnn, test_set, first,
+                                       std::min(static_cast<size_t>(EVAL_BATCH_SIZE), test_set.size() - first));
         }
-        double accuracy = static_cast<double>(correctPredictions) / totalPredictions;
-        std::cout << "Testing Accuracy = " << accuracy * 100.0 << "%" << std::endl;
 
-        auto end = std::chrono::high_resolution_clock::now();
-        std::chrono::duration<double> elapsed = end - start;
-        std::cout << "Testing completed in " << elapsed.count() << " seconds" << std::endl;
+        std::cout << "Target   Weights   Test       Weight     Dense     Dense" << std::endl;
+        std::cout << "sparsity zero      accuracy   memory KB  us/image  speedup" << std::endl;
+        double denseSeconds = 0.0;
+        for (const auto& level : pruningLevels) {
+            NeuralNet net = level.second;
+            if (level.first > 0.0) {
+                net.buildSparse();
+            }
+
+            std::vector<Matrix> probabilities(numBatches);
+            double seconds = -1.0;
+            for (int run = 0; run < 3; ++run) {
+                auto start = std::chrono::high_resolution_clock::now();
+                for (int b = 0; b < numBatches; ++b) {
+                    probabilities[b] = net.predictBatch(features[b]);
+                }
+                std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+                if (seconds < 0 || elapsed.count() < seconds) {
+                    seconds = elapsed.count();
+                }
+            }
+            if (level.first == 0.0) {
+                denseSeconds = seconds;
+            }
+
+            int correct = 0;
+            for (int b = 0; b < numBatches; ++b) {
+                for (size_t s = 0; s < features[b].getDims()[0]; ++s) {
+                    if (probabilities[b].argmaxRow(s) == test_set[b * EVAL_BATCH_SIZE + s].label) {
+                        correct++;
+                    }
+                }
+            }
+
+            std::cout << std::fixed << std::setprecision(2)
+                      << std::setw(7) << level.first * 100.0 << "%"
+                      << std::setw(8) << net.hiddenWeightSparsity() * 100.0 << "%"
+                      << std::setw(10) << (test_set.empty() ? 0.0 : correct * 100.0 / test_set.size()) << "%"
+                      << std::setw(11) << net.weightMemoryBytes() / 1024.0
+                      << std::setw(10) << (test_set.empty() ? 0.0 : seconds * 1e6 / test_set.size())
+                      << std::setw(8) << (seconds > 0.0 ? denseSeconds / seconds : 0.0) << "x" << std::endl;
+        }
+        std::cout.unsetf(std::ios_base::floatfield);
+        std::cout << std::setprecision(6);
     }
 
     //Creates a one-hot encoding of the actual output label associated with a given input
@@ -113,5 +403,4 @@ public:
     }
 };
 
-
-
+#endif
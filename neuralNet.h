@@ -1,8 +1,12 @@
+#ifndef NEURAL_NET_H
+#define NEURAL_NET_H
+
 #include <vector>
 #include <cmath>
 #include <chrono>
 #include "matrix.h"
 #include "data.h"
+#include "sparse.h"
 
 //Sizes of the intermediate layers are fixed
 //Size of the output is with respect to the 
@@ -11,6 +15,64 @@
 #define LAYER_2_SIZE 80
 #define OUTPUT_SIZE 10
 
+//Kernel configuration of each kind of GEMM the dense layers run, each tuned
+//with its own shapes (see autotune.h)
+struct DenseGemmConfig {
+    //One sample through a layer, forward or backpropagated: {1, n} x {n, m}
+    GemmConfig gemv;
+    //Weight gradients of one sample: {n, 1} x {1, m}
+    GemmConfig outer;
+    //Many samples at once (evaluation, pipeline micro-batches): {batch, n} x {n, m}
+    GemmConfig batch;
+};
+
+//Batched forward pass through the three dense layers, one row per sample,
+//shared by NeuralNet::predictBatch and DenseWeights::forwardBatch. The first
+//two layers multiply through "sparse_input_to_L1"/"sparse_L1_to_L2" instead
+//of their dense weights when those are given.
+void forwardDenseBatch(const Matrix& batch,
+                       const Matrix& weights_input_to_L1, const BlockSparseMatrix* sparse_input_to_L1, const Matrix& bias_L1,
+                       const Matrix& weights_L1_to_L2, const BlockSparseMatrix* sparse_L1_to_L2, const Matrix& bias_L2,
+                       const Matrix& weights_L2_to_output, const Matrix& bias_output,
+                       const GemmConfig& gemm, Matrix& l1, Matrix& l2, Matrix& out) {
+    l1 = (sparse_input_to_L1 ? sparse_input_to_L1->leftMultiply(batch)
+                             : batch.matrixMultiply(weights_input_to_L1, gemm)).addRowVector(bias_L1);
+    l1.relu();
+
+    l2 = (sparse_L1_to_L2 ? sparse_L1_to_L2->leftMultiply(l1)
+                          : l1.matrixMultiply(weights_L1_to_L2, gemm)).addRowVector(bias_L2);
+    l2.relu();
+
+    out = l2.matrixMultiply(weights_L2_to_output, gemm).addRowVector(bias_output);
+    for (double& val : out.getData()) {
+        val = 1.0 / (1.0 + exp(-val));
+    }
+}
+
+//Just the weights and biases of a NeuralNet, without its cached activations,
+//masks or sparse copies. Cheap to copy, so pipeline.h publishes these to the
+//forward stage instead of whole networks.
+struct DenseWeights {
+    Matrix weights_input_to_L1;
+    Matrix weights_L1_to_L2;
+    Matrix weights_L2_to_output;
+
+    Matrix bias_L1;
+    Matrix bias_L2;
+    Matrix bias_output;
+
+    //Configuration of the batched GEMMs (DenseGemmConfig::batch)
+    GemmConfig gemm;
+
+    //Batched forward pass that also hands back the hidden activations,
+    //one row per sample, so that NeuralNet::backwardFrom can be run on
+    //them later (possibly on another thread, see pipeline.h).
+    void forwardBatch(const Matrix& batch, Matrix& l1, Matrix& l2, Matrix& out) const {
+        forwardDenseBatch(batch, weights_input_to_L1, nullptr, bias_L1, weights_L1_to_L2, nullptr, bias_L2,
+                          weights_L2_to_output, bias_output, gemm, l1, l2, out);
+    }
+};
+
 /*
 Used to create objects that mimic a flat fully-connected
 neural network with 2 middle layers.
@@ -31,6 +93,24 @@ private:
     Matrix bias_L2;
     Matrix bias_output;
 
+    //Pruning state of the two hidden weight matrices. The masks hold 1 for
+    //live weights and 0 for pruned ones and keep pruned weights at zero
+    //while training continues.
+    bool pruned = false;
+    Matrix mask_input_to_L1;
+    Matrix mask_L1_to_L2;
+
+    //Block-sparse copies used by predictBatch once built. Any weight update
+    //makes them stale, so they are dropped in updateWeights.
+    bool sparseReady = false;
+    BlockSparseMatrix sparse_input_to_L1;
+    BlockSparseMatrix sparse_L1_to_L2;
+
+    //Kernel configuration of the GEMMs in this network (see autotune.h).
+    //It travels with copies of the network, so snapshots evaluated or
+    //trained on other threads use the same tuned kernels.
+    DenseGemmConfig gemm;
+
 public:
     Matrix output;  
 
@@ -51,37 +131,86 @@ public:
     }
 
 
+    void setGemmConfig(const DenseGemmConfig& config) {
+        gemm = config;
+    }
+
+    const DenseGemmConfig& getGemmConfig() const {
+        return gemm;
+    }
+
+
     void forwardPropagation(Matrix inData) {
         
         input = inData;
-        layer_1 = (input.matrixMultiply(weights_input_to_L1)).matrixAdd(bias_L1);
+        layer_1 = (input.matrixMultiply(weights_input_to_L1, gemm.gemv)).matrixAdd(bias_L1);
         layer_1.relu();  
 
-        layer_2 = (layer_1.matrixMultiply(weights_L1_to_L2)).matrixAdd(bias_L2);
+        layer_2 = (layer_1.matrixMultiply(weights_L1_to_L2, gemm.gemv)).matrixAdd(bias_L2);
         layer_2.relu(); 
 
-        output = (layer_2.matrixMultiply(weights_L2_to_output)).matrixAdd(bias_output);
+        output = (layer_2.matrixMultiply(weights_L2_to_output, gemm.gemv)).matrixAdd(bias_output);
         Matrix::sigmoid(&output);  
     }
 
+
+    //Read-only batched forward pass. Each row of "batch" is one flattened
+    //ConvLayer output; each row of the result holds the class probabilities
+    //for that sample. Does not touch the cached activations used by
+    //backwardPropagation, so it is safe to call concurrently.
+    //Uses the block-sparse kernels after buildSparse().
+    Matrix predictBatch(const Matrix& batch) const {
+        Matrix l1, l2, out;
+        forwardDenseBatch(batch,
+                          weights_input_to_L1, sparseReady ? &sparse_input_to_L1 : nullptr, bias_L1,
+                          weights_L1_to_L2, sparseReady ? &sparse_L1_to_L2 : nullptr, bias_L2,
+                          weights_L2_to_output, bias_output, gemm.batch, l1, l2, out);
+        return out;
+    }
+
+
+    //Copies the current weights and biases into "dest". Matrices of the same
+    //shape reuse their storage, so refreshing an existing copy does not allocate.
+    void copyWeightsTo(DenseWeights& dest) const {
+        dest.weights_input_to_L1 = weights_input_to_L1;
+        dest.weights_L1_to_L2 = weights_L1_to_L2;
+        dest.weights_L2_to_output = weights_L2_to_output;
+        dest.bias_L1 = bias_L1;
+        dest.bias_L2 = bias_L2;
+        dest.bias_output = bias_output;
+        dest.gemm = gemm.batch;
+    }
+
        
     void backwardPropagation(const Matrix &target, double learningRate) {
+        backwardFrom(weights_L1_to_L2, weights_L2_to_output, input, layer_1, layer_2, output, target, learningRate);
+    }
+
+
+    //Backpropagation for one sample from activations recorded by an earlier
+    //forward pass whose L1->L2 and L2->output weights were "forward_L1_to_L2"
+    //and "forward_L2_to_output", which may be older than this network's. The
+    //gradients are taken with those same weights, so they stay consistent with
+    //the activations, and are then applied to this network.
+    void backwardFrom(const Matrix &forward_L1_to_L2, const Matrix &forward_L2_to_output,
+                      const Matrix &input, const Matrix &layer_1, const Matrix &layer_2,
+                      const Matrix &output, const Matrix &target, double learningRate) {
     
         Matrix gradient_output = output.matrixSubtract(target);
 
-        Matrix gradient_weights_L2_to_output = layer_2.transpose().matrixMultiply(gradient_output);
+        Matrix gradient_weights_L2_to_output = layer_2.transpose().matrixMultiply(gradient_output, gemm.outer);
         Matrix gradient_bias_output = gradient_output;  
 
-        Matrix gradient_layer_2 = gradient_output.matrixMultiply(weights_L2_to_output.transpose());
+        Matrix gradient_layer_2 = gradient_output.matrixMultiply(forward_L2_to_output.transpose(), gemm.gemv);
         gradient_layer_2 = gradient_layer_2.elementwiseMultiply(layer_2.reluDerivative());
 
-        Matrix gradient_weights_L1_to_L2 = layer_1.transpose().matrixMultiply(gradient_layer_2);
+        Matrix gradient_weights_L1_to_L2 = layer_1.transpose().matrixMultiply(gradient_layer_2, gemm.outer);
         Matrix gradient_bias_L2 = gradient_layer_2; 
 
-        Matrix gradient_layer_1 = gradient_layer_2.matrixMultiply(weights_L1_to_L2.transpose());
+        Matrix gradient_layer_1 = gradient_layer_2.matrixMultiply(forward_L1_to_L2.transpose(), gemm.gemv);
         gradient_layer_1 = gradient_layer_1.elementwiseMultiply(layer_1.reluDerivative());
 
-        Matrix gradient_weights_input_to_L1 = input.transpose().matrixMultiply(gradient_layer_1);
+        Matrix gradient_weights_input_to_L1 = input.transpose().matrixMultiply(gradient_layer_1, gemm.outer);
         Matrix gradient_bias_L1 = gradient_layer_1;  
 
         updateWeights(learningRate, gradient_weights_input_to_L1, gradient_bias_L1, gradient_weights_L1_to_L2, gradient_bias_L2, gradient_weights_L2_to_output, gradient_bias_output);
@@ -97,7 +226,56 @@ public:
 
         weights_L2_to_output = weights_L2_to_output.matrixSubtract(gradient_weights_L2_to_output.scalarMultiply(learningRate));
         bias_output = bias_output.matrixSubtract(gradient_bias_output.scalarMultiply(learningRate));
+
+        if (pruned) {
+            weights_input_to_L1 = weights_input_to_L1.elementwiseMultiply(mask_input_to_L1);
+            weights_L1_to_L2 = weights_L1_to_L2.elementwiseMultiply(mask_L1_to_L2);
+        }
+        sparseReady = false;
+    }
+
+    //Magnitude pruning of the two hidden weight matrices: the blocks with the
+    //smallest weights are zeroed until "sparsity" of the blocks are gone.
+    //Works in the block shape of BlockSparseMatrix so that the pruned weights
+    //actually shrink when compressed. The small output layer is left dense.
+    void prune(double sparsity) {
+        if (!pruned) {
+            mask_input_to_L1 = Matrix(std::vector<double>(weights_input_to_L1.getData().size(), 1.0),
+                                      weights_input_to_L1.getDims());
+            mask_L1_to_L2 = Matrix(std::vector<double>(weights_L1_to_L2.getData().size(), 1.0),
+                                   weights_L1_to_L2.getDims());
+            pruned = true;
+        }
+        BlockSparseMatrix::pruneBlocks(weights_input_to_L1, mask_input_to_L1, sparsity);
+        BlockSparseMatrix::pruneBlocks(weights_L1_to_L2, mask_L1_to_L2, sparsity);
+        sparseReady = false;
+    }
+
+    //Compresses the hidden weight matrices so predictBatch runs on the sparse kernels
+    void buildSparse() {
+        sparse_input_to_L1 = BlockSparseMatrix(weights_input_to_L1);
+        sparse_L1_to_L2 = BlockSparseMatrix(weights_L1_to_L2);
+        sparseReady = true;
+    }
+
+    //Bytes held by all weights and biases, in the form predictBatch uses
+    size_t weightMemoryBytes() const {
+        size_t bytes = (weights_L2_to_output.getData().size() + bias_L1.getData().size()
+                      + bias_L2.getData().size() + bias_output.getData().size()) * sizeof(double);
+        if (sparseReady) {
+            return bytes + sparse_input_to_L1.memoryBytes() + sparse_L1_to_L2.memoryBytes();
+        }
+        return bytes + (weights_input_to_L1.getData().size() + weights_L1_to_L2.getData().size()) * sizeof(double);
+    }
+
+    //Fraction of the hidden layer weights that are exactly zero
+    double hiddenWeightSparsity() const {
+        size_t zeros = 0;
+        for (double w : weights_input_to_L1.getData()) zeros += (w == 0.0);
+        for (double w : weights_L1_to_L2.getData()) zeros += (w == 0.0);
+        return static_cast<double>(zeros) / (weights_input_to_L1.getData().size() + weights_L1_to_L2.getData().size());
     }
 
 };
 
+#endif
@@ -0,0 +1,240 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <exception>
+#include <omp.h>
+#include "conv_utils.h"
+#include "neuralNet.h"
+
+/*
+Pipeline-parallel training.
+One epoch is split into three stages that each run on their own thread
+and hand micro-batches to the next stage through lock-free SPSC queues:
+
+    conv stage     ConvLayer features of a micro-batch
+    forward stage  dense forward pass on a snapshot of the weights
+    update stage   per-sample backpropagation and SGD on the live weights
+
+While the update stage works on micro-batch b, the forward stage can
+already run b + 1 and the conv stage b + 2, so the stages overlap
+instead of running one after the other. Whether that is faster than the
+plain per-sample loop depends on the core count and the shapes; with one
+core the stages only take turns. The price is that the forward pass of
+micro-batch b may use weights that miss the updates of up to
+maxStaleness earlier micro-batches (plus those of earlier samples of its
+own micro-batch). To keep the gradients consistent with those
+activations, each micro-batch carries the weights its forward pass used,
+and the update stage backpropagates through them before applying the
+result to the live weights (weight stashing). Only the weights and
+biases (DenseWeights) are published, into recycled buffers, so
+publishing does not copy or allocate a whole NeuralNet.
+*/
+
+//Bounded single-producer single-consumer ring buffer. Only one thread
+//may push and only one other thread may pop.
+template <typename T>
+class SPSCQueue {
+private:
+    //One slot is always left empty to tell a full queue from an empty one
+    std::vector<T> slots;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+
+public:
+    explicit SPSCQueue(size_t capacity) : slots(capacity + 1), head(0), tail(0) {}
+
+    bool tryPush(T&& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % slots.size();
+        if (next == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        slots[t] = std::move(item);
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(slots[h]);
+        head.store((h + 1) % slots.size(), std::memory_order_release);
+        return true;
+    }
+};
+
+//What travels between the stages. "count" == 0 marks the end of the epoch.
+struct MicroBatch {
+    size_t first = 0;
+    size_t count = 0;
+    Matrix features;
+    Matrix layer_1;
+    Matrix layer_2;
+    Matrix output;
+    //The weights the forward stage used, kept for the update stage
+    std::shared_ptr<const DenseWeights> weights;
+};
+
+//Spins (yielding) until "attempt" succeeds. Returns false if another stage failed.
+template <typename Fn>
+bool spinUntil(const std::atomic<bool>& failed, Fn attempt) {
+    while (!attempt()) {
+        if (failed.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+//Trains "flat" for one epoch over "data" with the three stage pipeline.
+//Returns the training accuracy, counted on the forward stage's predictions.
+double runPipelinedEpoch(const ConvLayer& cnn, NeuralNet& flat,
+                         const std::vector<MNISTImage>& data, double learningRate,
+                         size_t microBatch, size_t maxStaleness) {
+    microBatch = std::max(static_cast<size_t>(1), microBatch);
+    const size_t flatSize = cnn.flatSize;
+    const size_t numBatches = (data.size() + microBatch - 1) / microBatch;
+
+    SPSCQueue<MicroBatch> convToForward(maxStaleness + 1);
+    SPSCQueue<MicroBatch> forwardToUpdate(maxStaleness + 1);
+
+    //Latest weights published by the update stage, and how many
+    //micro-batches they include
+    std::shared_ptr<DenseWeights> initial = std::make_shared<DenseWeights>();
+    flat.copyWeightsTo(*initial);
+    std::shared_ptr<const DenseWeights> published = initial;
+    std::atomic<size_t> publishedBatches(0);
+
+    //Buffers the update stage publishes into. A buffer only the pool still
+    //references is neither published nor held by a micro-batch in flight,
+    //so it can be overwritten; a new one is added when none is free.
+    std::vector<std::shared_ptr<DenseWeights>> pool(1, initial);
+    initial.reset();
+    auto freeBuffer = [&]() -> std::shared_ptr<DenseWeights> {
+        for (const auto& buffer : pool) {
+            if (buffer.use_count() == 1) {
+                //Pairs with the release in the other threads' shared_ptr destructors
+                std::atomic_thread_fence(std::memory_order_acquire);
+                return buffer;
+            }
+        }
+        pool.push_back(std::make_shared<DenseWeights>());
+        return pool.back();
+    };
+
+    std::atomic<bool> failed(false);
+    std::exception_ptr errors[3];
+    int correctPredictions = 0;
+
+    auto convStage = [&]() {
+        try {
+            for (size_t b = 0; b <= numBatches; ++b) {
+                MicroBatch mb;
+                if (b < numBatches) {
+                    mb.first = b * microBatch;
+                    mb.count = std::min(microBatch, data.size() - mb.first);
+                    mb.features = Matrix({mb.count, flatSize});
+                    std::vector<double>& featureData = mb.features.getData();
+
+                    #pragma omp parallel for num_threads(cnn.getConvThreads())
+                    for (long s = 0; s < static_cast<long>(mb.count); ++s) {
+                        Matrix features = cnn.infer(data[mb.first + s].imageTensor);
+                        std::copy(features.getData().begin(), features.getData().end(),
+                                  featureData.begin() + s * flatSize);
+                    }
+                }
+                if (!spinUntil(failed, [&]() { return convToForward.tryPush(std::move(mb)); })) {
+                    return;
+                }
+            }
+        } catch (...) {
+            errors[0] = std::current_exception();
+            failed = true;
+        }
+    };
+
+    auto forwardStage = [&]() {
+        try {
+            for (size_t b = 0; ; ++b) {
+                MicroBatch mb;
+                if (!spinUntil(failed, [&]() { return convToForward.tryPop(mb); })) {
+                    return;
+                }
+                if (mb.count > 0) {
+                    //Bounded staleness: wait until the weights include every
+                    //micro-batch older than b - maxStaleness
+                    size_t required = b > maxStaleness ? b - maxStaleness : 0;
+                    if (!spinUntil(failed, [&]() { return publishedBatches.load(std::memory_order_acquire) >= required; })) {
+                        return;
+                    }
+                    mb.weights = std::atomic_load(&published);
+                    mb.weights->forwardBatch(mb.features, mb.layer_1, mb.layer_2, mb.output);
+
+                    for (size_t s = 0; s < mb.count; ++s) {
+                        if (mb.output.argmaxRow(s) == data[mb.first + s].label) {
+                            correctPredictions++;
+                        }
+                    }
+                }
+                bool last = mb.count == 0;
+                if (!spinUntil(failed, [&]() { return forwardToUpdate.tryPush(std::move(mb)); }) || last) {
+                    return;
+                }
+            }
+        } catch (...) {
+            errors[1] = std::current_exception();
+            failed = true;
+        }
+    };
+
+    auto updateStage = [&]() {
+        try {
+            for (size_t b = 0; ; ++b) {
+                MicroBatch mb;
+                if (!spinUntil(failed, [&]() { return forwardToUpdate.tryPop(mb); })) {
+                    return;
+                }
+                if (mb.count == 0) {
+                    return;
+                }
+                for (size_t s = 0; s < mb.count; ++s) {
+                    std::vector<double> target(OUTPUT_SIZE, 0.0);
+                    target[data[mb.first + s].label] = 1.0;
+                    flat.backwardFrom(mb.weights->weights_L1_to_L2, mb.weights->weights_L2_to_output,
+                                      mb.features.getRow(s), mb.layer_1.getRow(s), mb.layer_2.getRow(s),
+                                      mb.output.getRow(s), Matrix(target, {1, OUTPUT_SIZE}), learningRate);
+                }
+                mb.weights.reset();
+                std::shared_ptr<DenseWeights> next = freeBuffer();
+                flat.copyWeightsTo(*next);
+                std::atomic_store(&published, std::shared_ptr<const DenseWeights>(std::move(next)));
+                publishedBatches.store(b + 1, std::memory_order_release);
+            }
+        } catch (...) {
+            errors[2] = std::current_exception();
+            failed = true;
+        }
+    };
+
+    std::thread conv(convStage);
+    std::thread forward(forwardStage);
+    updateStage();
+    conv.join();
+    forward.join();
+
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    return data.empty() ? 0.0 : static_cast<double>(correctPredictions) / data.size();
+}
+
+#endif
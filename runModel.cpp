@@ -3,18 +3,37 @@
 #include <chrono>
 #include <string>
 #include "model.h"
+#include "sweep.h"
 
 /*
 The driver program.
 Takes in  the comand-line args and creates the model object.
 Subsequently it calls the train and test methods respectively.
+With --sweep it instead trains every configuration listed in a
+sweep file concurrently (see sweep.h).
 
 Author: ac2255@g.rit.edu
 */
 int main( int argc, char* argv[] ) {
 
-  if (argc != 5) {
-        std::cerr << "Usage: ./runModel filterSize numFilters learning_rate epochs\n";
+  if (argc >= 2 && std::string(argv[1]) == "--sweep") {
+        if (argc < 3 || argc > 4) {
+            std::cerr << "Usage: ./runModel --sweep sweepFile [coresPerJob]\n";
+            return 1;
+        }
+        try {
+            int coresPerJob = argc > 3 ? std::stoi(argv[3]) : 1;
+            runSweep(argv[2], coresPerJob);
+            return 0;
+        } catch (const std::exception& e) {
+            std::cerr << "Sweep failed: " << e.what() << '\n';
+            return 1;
+        }
+    }
+
+  if (argc < 5 || argc > 10) {
+        std::cerr << "Usage: ./runModel filterSize numFilters learning_rate epochs [evalEvery [patience [targetSparsity [microBatch [skipQuantile]]]]]\n"
+                  << "       ./runModel --sweep sweepFile [coresPerJob]\n";
         return 1;
     }
 
@@ -23,8 +42,21 @@ int main( int argc, char* argv[] ) {
         int numFilters = std::stoi(argv[2]); 
         double learning_rate = std::stod(argv[3]); 
         int epochs = std::stoi(argv[4]); 
+        int evalEvery = argc > 5 ? std::stoi(argv[5]) : 0;
+        int patience = argc > 6 ? std::stoi(argv[6]) : 3;
+        double targetSparsity = argc > 7 ? std::stod(argv[7]) : 0.0;
+        int microBatch = argc > 8 ? std::stoi(argv[8]) : 0;
+        double skipQuantile = argc > 9 ? std::stod(argv[9]) : 0.0;
+        //The pipelined trainer always runs every backward pass
+        if (microBatch > 0 && skipQuantile > 0.0) {
+            std::cerr << "microBatch and skipQuantile cannot be combined; set one of them to 0.\n";
+            return 1;
+        }
 
-        Model miniCon = Model(filterSize, numFilters, learning_rate, epochs);
+        Model miniCon = Model(filterSize, numFilters, learning_rate, epochs, evalEvery, patience);
+        miniCon.targetSparsity = targetSparsity;
+        miniCon.microBatch = static_cast<size_t>(std::max(0, microBatch));
+        miniCon.selector.skipQuantile = skipQuantile;
         miniCon.train();
         miniCon.test();
         return 0;
@@ -0,0 +1,161 @@
+#ifndef SELECTIVE_H
+#define SELECTIVE_H
+
+#include <vector>
+#include <cmath>
+#include <random>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include "matrix.h"
+
+//Number of recent losses the skip threshold is taken from
+#define SELECTIVE_WINDOW 2048
+//The threshold is recomputed after this many samples
+#define SELECTIVE_REFRESH 256
+
+/*
+Selective backpropagation.
+Late in training most samples are already classified correctly with high
+confidence, and their backward pass barely moves the weights. This keeps
+the loss of every sample and lets the training loop:
+  - skip the backward pass of samples whose loss is below the skipQuantile
+    quantile of the recent losses, except for a keepProbability share of
+    them so that easy samples are not forgotten entirely,
+  - revisit the hardest samples (by their last loss) once more at the end
+    of the epoch.
+The first warmupEpochs epochs always run every backward pass.
+*/
+class SelectiveBackprop {
+private:
+    std::vector<double> lastLoss;
+    std::vector<double> window;
+    size_t windowPos = 0;
+    size_t sinceRefresh = 0;
+    double threshold = 0.0;
+    std::mt19937 gen;
+    std::uniform_real_distribution<double> coin;
+
+public:
+    double skipQuantile = 0.0;
+    double keepProbability = 0.1;
+    double revisitFraction = 0.05;
+    int warmupEpochs = 1;
+
+    //Backward passes run and skipped in the current epoch / overall,
+    //revisits included
+    size_t epochBackward = 0;
+    size_t epochSkipped = 0;
+    size_t totalBackward = 0;
+    size_t totalSkipped = 0;
+    //Distinct samples and extra revisit passes of the current epoch / overall
+    size_t epochSamples = 0;
+    size_t epochRevisits = 0;
+    size_t totalSamples = 0;
+    size_t totalRevisits = 0;
+
+    SelectiveBackprop() : gen(739), coin(0.0, 1.0) {}
+
+    bool enabled() const {
+        return skipQuantile > 0.0;
+    }
+
+    //Binary cross-entropy of the sigmoid outputs against the one-hot label,
+    //the loss whose gradient NeuralNet::backwardPropagation follows
+    static double sampleLoss(const Matrix& output, int label) {
+        const double eps = 1e-12;
+        double loss = 0.0;
+        const std::vector<double>& out = output.getData();
+        for (size_t c = 0; c < out.size(); ++c) {
+            double p = std::min(std::max(out[c], eps), 1.0 - eps);
+            loss -= (static_cast<int>(c) == label) ? std::log(p) : std::log(1.0 - p);
+        }
+        return loss;
+    }
+
+    //Call before each epoch. Returns the order to visit the samples in:
+    //every sample once, followed by the hardest ones a second time.
+    std::vector<size_t> beginEpoch(int epoch, size_t numSamples) {
+        if (enabled() && lastLoss.size() != numSamples) {
+            lastLoss.assign(numSamples, std::numeric_limits<double>::infinity());
+        }
+        epochBackward = 0;
+        epochSkipped = 0;
+        epochSamples = numSamples;
+        epochRevisits = 0;
+        totalSamples += numSamples;
+
+        std::vector<size_t> order(numSamples);
+        std::iota(order.begin(), order.end(), 0);
+        if (!enabled() || epoch < warmupEpochs) {
+            return order;
+        }
+
+        size_t numRevisits = static_cast<size_t>(revisitFraction * numSamples);
+        std::vector<size_t> hardest(order);
+        std::partial_sort(hardest.begin(), hardest.begin() + numRevisits, hardest.end(),
+                          [this](size_t a, size_t b) { return lastLoss[a] > lastLoss[b]; });
+        order.insert(order.end(), hardest.begin(), hardest.begin() + numRevisits);
+        epochRevisits = numRevisits;
+        totalRevisits += numRevisits;
+        return order;
+    }
+
+    //Records the loss of sample "index" and decides whether its backward pass runs.
+    //Only call this when enabled(); otherwise every backward pass runs.
+    //The comparison is strict: the sigmoid outputs saturate, so many samples
+    //share the same minimal loss, and all of them count as easy.
+    bool shouldBackprop(int epoch, size_t index, double loss) {
+        lastLoss[index] = loss;
+        record(loss);
+
+        bool run = epoch < warmupEpochs || loss > threshold
+                   || coin(gen) < keepProbability;
+        if (run) {
+            epochBackward++;
+            totalBackward++;
+        } else {
+            epochSkipped++;
+            totalSkipped++;
+        }
+        return run;
+    }
+
+    //Backward passes saved against the baseline of one per sample, i.e.
+    //1 - backward passes run / samples. Revisits count as run passes, so
+    //this can go negative when few samples are skipped.
+    double epochSavedFraction() const {
+        return savedFraction(epochBackward, epochSamples);
+    }
+
+    double totalSavedFraction() const {
+        return savedFraction(totalBackward, totalSamples);
+    }
+
+private:
+    double savedFraction(size_t backward, size_t samples) const {
+        if (!enabled() || samples == 0) {
+            return 0.0;
+        }
+        return 1.0 - static_cast<double>(backward) / samples;
+    }
+
+    //Adds a loss to the window and refreshes the threshold now and then
+    void record(double loss) {
+        if (window.size() < SELECTIVE_WINDOW) {
+            window.push_back(loss);
+        } else {
+            window[windowPos] = loss;
+            windowPos = (windowPos + 1) % SELECTIVE_WINDOW;
+        }
+        if (++sinceRefresh >= SELECTIVE_REFRESH) {
+            sinceRefresh = 0;
+            std::vector<double> sorted(window);
+            size_t k = std::min(sorted.size() - 1, static_cast<size_t>(skipQuantile * sorted.size()));
+            std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+            threshold = sorted[k];
+        }
+    }
+};
+
+#endif
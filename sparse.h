@@ -0,0 +1,169 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include "matrix.h"
+
+//Shape of the blocks the pruned weights are stored in. The columns of a
+//block are contiguous, so the inner kernel loop is a fixed length vector op.
+#define SPARSE_BLOCK_ROWS 4
+#define SPARSE_BLOCK_COLS 8
+
+/*
+Block-sparse (BSR) storage for pruned weight matrices.
+Only the SPARSE_BLOCK_ROWS x SPARSE_BLOCK_COLS blocks that still hold a
+non-zero weight are kept, row of blocks by row of blocks. Edge blocks are
+zero padded so that every block has the same shape.
+*/
+class BlockSparseMatrix {
+private:
+    size_t rows = 0;
+    size_t cols = 0;
+    size_t blockRowCount = 0;
+    size_t blockColCount = 0;
+    //Start of each block row in blockCols/values (blockRowCount + 1 entries)
+    std::vector<size_t> rowPtr;
+    //Block column index of every stored block
+    std::vector<size_t> blockCols;
+    //Stored blocks, SPARSE_BLOCK_ROWS * SPARSE_BLOCK_COLS values each, row major
+    std::vector<double> values;
+
+public:
+    BlockSparseMatrix(){}
+
+    //Compresses a dense matrix, dropping all blocks that are entirely zero
+    explicit BlockSparseMatrix(const Matrix& dense) {
+        rows = dense.getDims()[0];
+        cols = dense.getDims()[1];
+        blockRowCount = (rows + SPARSE_BLOCK_ROWS - 1) / SPARSE_BLOCK_ROWS;
+        blockColCount = (cols + SPARSE_BLOCK_COLS - 1) / SPARSE_BLOCK_COLS;
+        const std::vector<double>& data = dense.getData();
+
+        rowPtr.push_back(0);
+        for (size_t br = 0; br < blockRowCount; ++br) {
+            for (size_t bc = 0; bc < blockColCount; ++bc) {
+                double block[SPARSE_BLOCK_ROWS * SPARSE_BLOCK_COLS] = {0.0};
+                bool nonZero = false;
+                for (size_t r = 0; r < SPARSE_BLOCK_ROWS; ++r) {
+                    size_t row = br * SPARSE_BLOCK_ROWS + r;
+                    for (size_t c = 0; c < SPARSE_BLOCK_COLS; ++c) {
+                        size_t col = bc * SPARSE_BLOCK_COLS + c;
+                        if (row < rows && col < cols && data[row * cols + col] != 0.0) {
+                            block[r * SPARSE_BLOCK_COLS + c] = data[row * cols + col];
+                            nonZero = true;
+                        }
+                    }
+                }
+                if (nonZero) {
+                    blockCols.push_back(bc);
+                    values.insert(values.end(), block, block + SPARSE_BLOCK_ROWS * SPARSE_BLOCK_COLS);
+                }
+            }
+            rowPtr.push_back(blockCols.size());
+        }
+    }
+
+    size_t numStoredBlocks() const {
+        return blockCols.size();
+    }
+
+    //Fraction of blocks that were dropped
+    double blockSparsity() const {
+        size_t total = blockRowCount * blockColCount;
+        return total == 0 ? 0.0 : 1.0 - static_cast<double>(blockCols.size()) / total;
+    }
+
+    //Bytes held by the values and the index arrays
+    size_t memoryBytes() const {
+        return values.size() * sizeof(double)
+             + blockCols.size() * sizeof(size_t)
+             + rowPtr.size() * sizeof(size_t);
+    }
+
+    //Computes input * this, where input is {n, rows}; n == 1 is the GEMV case.
+    //Every input element is broadcast against one row of a stored block,
+    //so the inner loop is a fixed SPARSE_BLOCK_COLS wide multiply-add.
+    Matrix leftMultiply(const Matrix& input) const {
+        if (input.getDims()[1] != rows) {
+            throw std::invalid_argument("Matrix dimensions incompatible for sparse multiplication.");
+        }
+        size_t n = input.getDims()[0];
+        size_t paddedCols = blockColCount * SPARSE_BLOCK_COLS;
+        const std::vector<double>& in = input.getData();
+        std::vector<double> padded(n * paddedCols, 0.0);
+
+        for (size_t i = 0; i < n; ++i) {
+            const double* inRow = in.data() + i * rows;
+            double* outRow = padded.data() + i * paddedCols;
+            for (size_t br = 0; br < blockRowCount; ++br) {
+                size_t rowStart = br * SPARSE_BLOCK_ROWS;
+                size_t rowCount = std::min(static_cast<size_t>(SPARSE_BLOCK_ROWS), rows - rowStart);
+                for (size_t b = rowPtr[br]; b < rowPtr[br + 1]; ++b) {
+                    const double* block = values.data() + b * SPARSE_BLOCK_ROWS * SPARSE_BLOCK_COLS;
+                    double* out = outRow + blockCols[b] * SPARSE_BLOCK_COLS;
+                    for (size_t r = 0; r < rowCount; ++r) {
+                        double a = inRow[rowStart + r];
+                        const double* w = block + r * SPARSE_BLOCK_COLS;
+                        #pragma omp simd
+                        for (size_t c = 0; c < SPARSE_BLOCK_COLS; ++c) {
+                            out[c] += a * w[c];
+                        }
+                    }
+                }
+            }
+        }
+
+        if (paddedCols == cols) {
+            return Matrix(padded, {n, cols});
+        }
+        std::vector<double> resultData(n * cols);
+        for (size_t i = 0; i < n; ++i) {
+            std::copy(padded.begin() + i * paddedCols, padded.begin() + i * paddedCols + cols,
+                      resultData.begin() + i * cols);
+        }
+        return Matrix(resultData, {n, cols});
+    }
+
+    //Zeroes the smallest blocks (by sum of squares) of "weights" and "mask"
+    //until at least "sparsity" of the blocks are zero. Blocks that are already
+    //masked out have norm 0 and are picked first, so calling this with a
+    //growing sparsity prunes iteratively.
+    static void pruneBlocks(Matrix& weights, Matrix& mask, double sparsity) {
+        size_t rows = weights.getDims()[0];
+        size_t cols = weights.getDims()[1];
+        size_t blockRowCount = (rows + SPARSE_BLOCK_ROWS - 1) / SPARSE_BLOCK_ROWS;
+        size_t blockColCount = (cols + SPARSE_BLOCK_COLS - 1) / SPARSE_BLOCK_COLS;
+        std::vector<double>& w = weights.getData();
+        std::vector<double>& m = mask.getData();
+
+        std::vector<double> norms(blockRowCount * blockColCount, 0.0);
+        for (size_t row = 0; row < rows; ++row) {
+            for (size_t col = 0; col < cols; ++col) {
+                double val = w[row * cols + col] * m[row * cols + col];
+                norms[(row / SPARSE_BLOCK_ROWS) * blockColCount + col / SPARSE_BLOCK_COLS] += val * val;
+            }
+        }
+
+        std::vector<size_t> order(norms.size());
+        std::iota(order.begin(), order.end(), 0);
+        size_t numPruned = static_cast<size_t>(std::max(0.0, std::min(1.0, sparsity)) * norms.size());
+        std::nth_element(order.begin(), order.begin() + numPruned, order.end(),
+                         [&norms](size_t a, size_t b) { return norms[a] < norms[b]; });
+
+        for (size_t p = 0; p < numPruned; ++p) {
+            size_t br = order[p] / blockColCount;
+            size_t bc = order[p] % blockColCount;
+            for (size_t row = br * SPARSE_BLOCK_ROWS; row < std::min(rows, (br + 1) * SPARSE_BLOCK_ROWS); ++row) {
+                for (size_t col = bc * SPARSE_BLOCK_COLS; col < std::min(cols, (bc + 1) * SPARSE_BLOCK_COLS); ++col) {
+                    w[row * cols + col] = 0.0;
+                    m[row * cols + col] = 0.0;
+                }
+            }
+        }
+    }
+};
+
+#endif
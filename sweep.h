@@ -0,0 +1,275 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <omp.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "model.h"
+
+//Results of a sweep are written here, one tab separated row per configuration
+#define SWEEP_RESULTS_FILE "sweep_results.tsv"
+
+/*
+Hyperparameter sweep runner.
+Loads the training and testing sets once, then trains many Model
+instances at the same time over that shared, read-only data. Every
+concurrent job is pinned to its own subset of the cores the process may
+use and runs its OpenMP kernels only on those cores.
+
+Sweep file format, one configuration per line:
+    filterSize numFilters learning_rate epochs [skipQuantile]
+skipQuantile turns on selective backprop (see selective.h) and defaults to 0.
+Any column may hold a comma separated list, in which case the line
+expands into every combination (a grid). Lines starting with # are ignored.
+*/
+
+//One point of the sweep, and what came out of it
+struct SweepJob {
+    int filterSize;
+    int numFilters;
+    double learningRate;
+    int epochs;
+    double skipQuantile = 0.0;
+
+    int epochsRun = 0;
+    double trainAccuracy = 0.0;
+    double testAccuracy = 0.0;
+    double trainSeconds = 0.0;
+    double testSeconds = 0.0;
+    //-1 if 98.5% training accuracy was never reached
+    double secondsTo985 = -1.0;
+    //Backward passes saved by selective backprop, against one per sample
+    double backwardSaved = 0.0;
+    std::string error;
+};
+
+//Splits "a,b,c" into its values, converted with "convert"
+template <typename T, typename Fn>
+std::vector<T> parseSweepValues(const std::string& field, Fn convert) {
+    std::vector<T> values;
+    std::stringstream stream(field);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) {
+            values.push_back(convert(item));
+        }
+    }
+    if (values.empty()) {
+        throw std::invalid_argument("Empty value list in sweep file: " + field);
+    }
+    return values;
+}
+
+//Reads a sweep file and expands every line into its configurations
+std::vector<SweepJob> readSweepFile(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        throw std::invalid_argument("Failed to open sweep file: " + filename);
+    }
+
+    auto toInt = [](const std::string& s) { return std::stoi(s); };
+    auto toDouble = [](const std::string& s) { return std::stod(s); };
+
+    std::vector<SweepJob> jobs;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string fs, nf, lr, ep, sq;
+        if (!(fields >> fs) || fs[0] == '#') {
+            continue;
+        }
+        if (!(fields >> nf >> lr >> ep)) {
+            throw std::invalid_argument("Sweep line needs 4 columns: " + line);
+        }
+        if (!(fields >> sq)) {
+            sq = "0";
+        }
+
+        for (int filterSize : parseSweepValues<int>(fs, toInt)) {
+            for (int numFilters : parseSweepValues<int>(nf, toInt)) {
+                for (double learningRate : parseSweepValues<double>(lr, toDouble)) {
+                    for (int epochs : parseSweepValues<int>(ep, toInt)) {
+                        for (double skipQuantile : parseSweepValues<double>(sq, toDouble)) {
+                            SweepJob job;
+                            job.filterSize = filterSize;
+                            job.numFilters = numFilters;
+                            job.learningRate = learningRate;
+                            job.epochs = epochs;
+                            job.skipQuantile = skipQuantile;
+                            jobs.push_back(job);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return jobs;
+}
+
+//The CPUs this process may run on. Honours taskset, cgroup cpusets and
+//container limits on Linux; elsewhere every hardware thread is assumed usable.
+std::vector<int> allowedCpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; ++c) {
+            if (CPU_ISSET(c, &mask)) {
+                cpus.push_back(c);
+            }
+        }
+    }
+#endif
+    if (cpus.empty()) {
+        int count = std::max(1u, std::thread::hardware_concurrency());
+        for (int c = 0; c < count; ++c) {
+            cpus.push_back(c);
+        }
+    }
+    return cpus;
+}
+
+//Restricts the calling thread (and the OpenMP threads it later spawns,
+//which inherit the mask) to "cpus".
+//Not supported on macOS, where this is a no-op.
+void pinToCores(const std::vector<int>& cpus) {
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int c : cpus) {
+        CPU_SET(c, &mask);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) != 0) {
+        std::cerr << "Failed to pin sweep worker to cores " << cpus.front() << "-"
+                  << cpus.back() << std::endl;
+    }
+#else
+    (void)cpus;
+#endif
+}
+
+void printSweepTable(std::ostream& out, const std::vector<SweepJob>& jobs) {
+    out << "filterSize\tnumFilters\tlearning_rate\tepochs\tskipQuantile\tepochsRun"
+        << "\ttrainAccuracy\ttestAccuracy\ttrainSeconds\tsecondsTo985\tbackwardSaved"
+        << "\ttestSeconds\terror\n";
+    for (const auto& job : jobs) {
+        out << job.filterSize << '\t' << job.numFilters << '\t' << job.learningRate << '\t'
+            << job.epochs << '\t' << job.skipQuantile << '\t' << job.epochsRun << '\t'
+            << job.trainAccuracy * 100.0 << '\t' << job.testAccuracy * 100.0 << '\t'
+            << job.trainSeconds << '\t';
+        if (job.secondsTo985 < 0) {
+            out << '-';
+        } else {
+            out << job.secondsTo985;
+        }
+        out << '\t' << job.backwardSaved * 100.0 << '\t' << job.testSeconds << '\t'
+            << (job.error.empty() ? "-" : job.error) << '\n';
+    }
+}
+
+//Trains and tests every configuration in "sweepFile", "coresPerJob" cores
+//per concurrently running model, and writes the result table.
+void runSweep(const std::string& sweepFile, int coresPerJob) {
+    std::vector<SweepJob> jobs = readSweepFile(sweepFile);
+    if (jobs.empty()) {
+        std::cerr << "No configurations in sweep file: " << sweepFile << std::endl;
+        return;
+    }
+
+    std::vector<int> cpus = allowedCpus();
+    int totalCores = static_cast<int>(cpus.size());
+    coresPerJob = std::min(std::max(1, coresPerJob), totalCores);
+    int numWorkers = std::min(static_cast<int>(jobs.size()), totalCores / coresPerJob);
+
+    //Loaded once, shared read-only by every model
+    SharedDataset training_data = Model::loadData(TRAIN_IMAGES_FILE, TRAIN_LABELS_FILE);
+    SharedDataset testing_data = Model::loadData(TEST_IMAGES_FILE, TEST_LABELS_FILE);
+    if (training_data->empty()) {
+        std::cerr << "No training data loaded." << std::endl;
+        return;
+    }
+
+    //Kernels are tuned up front, one job at a time, for a "coresPerJob"
+    //sized machine, so the timings are not disturbed by running jobs.
+    omp_set_num_threads(coresPerJob);
+    std::vector<KernelConfig> kernels(jobs.size());
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        ConvLayer probe((*training_data)[0].rows, jobs[j].filterSize, jobs[j].numFilters);
+        NeuralNet probeNet(probe.flatSize);
+        kernels[j] = Autotuner::configure(probe, probeNet, *training_data, TUNING_CACHE_FILE);
+    }
+
+    std::cout << "Running " << jobs.size() << " configurations, " << numWorkers
+              << " at a time on " << coresPerJob << " core(s) each" << std::endl;
+
+    std::atomic<size_t> nextJob(0);
+    std::mutex printLock;
+    auto worker = [&](int slot) {
+        pinToCores(std::vector<int>(cpus.begin() + slot * coresPerJob,
+                                    cpus.begin() + (slot + 1) * coresPerJob));
+        omp_set_num_threads(coresPerJob);
+
+        for (size_t j = nextJob++; j < jobs.size(); j = nextJob++) {
+            SweepJob& job = jobs[j];
+            try {
+                Model model(job.filterSize, job.numFilters, job.learningRate, job.epochs,
+                            training_data, testing_data);
+                model.verbose = false;
+                model.selector.skipQuantile = job.skipQuantile;
+                Autotuner::apply(model.cnn, model.flat, kernels[j]);
+
+                model.train();
+                EvalReport report = model.test();
+
+                job.epochsRun = model.epochsRun;
+                job.trainAccuracy = model.trainAccuracy;
+                job.trainSeconds = model.trainSeconds;
+                job.secondsTo985 = model.secondsTo985;
+                job.backwardSaved = model.selector.totalSavedFraction();
+                job.testAccuracy = report.accuracy();
+                job.testSeconds = report.seconds;
+            } catch (const std::exception& e) {
+                job.error = e.what();
+            }
+
+            std::lock_guard<std::mutex> guard(printLock);
+            std::cout << "[" << j + 1 << "/" << jobs.size() << "] filterSize=" << job.filterSize
+                      << " numFilters=" << job.numFilters << " learning_rate=" << job.learningRate
+                      << " epochs=" << job.epochs << " skipQuantile=" << job.skipQuantile << ": test accuracy " << job.testAccuracy * 100.0
+                      << "%, " << job.trainSeconds << " s" << std::endl;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int slot = 0; slot < numWorkers; ++slot) {
+        workers.emplace_back(worker, slot);
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+
+    std::cout << "----------------------------------------------------\n";
+    printSweepTable(std::cout, jobs);
+
+    std::ofstream results(SWEEP_RESULTS_FILE);
+    if (results.is_open()) {
+        printSweepTable(results, jobs);
+        std::cout << "Results written to " << SWEEP_RESULTS_FILE << std::endl;
+    } else {
+        std::cerr << "Failed to write sweep results: " << SWEEP_RESULTS_FILE << std::endl;
+    }
+}
+
+#endif